@@ -4,30 +4,93 @@
  * MIT License
  *
  * Compile:
- *   clang++ -std=c++11 -o minrpn minrpn.cpp
+ *   clang++ -std=c++11 -pthread -o minrpn minrpn.cpp
  * Compile with warnings:
- *   clang++ -std=c++11 -Weverything -Wno-padded -Wno-c++98-compat -Wno-global-constructors -Wno-exit-time-destructors -Wno-c99-extensions -o minrpn minrpn.cpp
+ *   clang++ -std=c++11 -Weverything -Wno-padded -Wno-c++98-compat -Wno-global-constructors -Wno-exit-time-destructors -Wno-c99-extensions -pthread -o minrpn minrpn.cpp
  * Usage:
  *   ./minrpn
+ *   ./minrpn --approx 3.14159265358979 [--terms 7]
+ *   ./minrpn --isa generic    (or sse4.2, avx2, avx512; default: best available)
+ *   ./minrpn --tune [--profile ~/.minrpn-profile]
+ *   ./minrpn --goal 1000
+ *   ./minrpn --batch [--slice 64] < goals.txt
+ *   ./minrpn --metrics-port 9469    (or --metrics-socket /run/minrpn.sock)
+ *   ./minrpn --rational 12
+ *   ./minrpn --prune-report [--no-prune recache] [--no-prune discover] [--no-prune loop]
+ *   ./minrpn --compress
+ *   ./minrpn --word 32 --operands 0xff,16 --goal 0xff00ff
  */
 
+#include <algorithm> /* find, lower_bound, sort */
+#include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <chrono> /* steady_clock */
 #include <cmath> /* fabs */
+#include <cstdint> /* SIZE_MAX, uint64_t */
+#include <cstdlib> /* strtod, strtol */
+#include <cstring> /* strcmp, memcpy */
+#include <fstream>
+#include <iomanip> /* setprecision */
 #include <iostream>
+#include <iterator> /* begin, end */
 #include <map>
+#include <memory> /* unique_ptr */
+#include <new> /* bad_alloc, placement new */
+#include <sstream>
 #include <stack>
+#include <string>
+#include <thread>
 #include <unordered_map>
+#include <utility> /* forward */
+#include <vector>
+
+#include <netinet/in.h> /* sockaddr_in, htons */
+#include <pthread.h> /* pthread_getcpuclockid */
+#include <sys/socket.h>
+#include <sys/stat.h> /* lstat, S_ISSOCK */
+#include <sys/un.h> /* sockaddr_un */
+#include <time.h> /* clock_gettime */
+#include <unistd.h> /* close, sysconf */
 
 /* Some configuration / pruning */
 typedef long arith_t;
 static const arith_t max_relevant = 420 * 3000;
-static const arith_t goal = 2017;
+static const arith_t default_goal = 2017;
 
 enum arith_op : char {
     /* Enums which store the character used to represent them. */
-    OP_PLUS = '+', OP_MINUS = '-', OP_DIV = '/', OP_MULT = '*', OP_NONE = '='
+    OP_PLUS = '+', OP_MINUS = '-', OP_DIV = '/', OP_MULT = '*', OP_NONE = '=',
+    /* Only in word mode.  Shifts print as two characters, see 'op_symbol'. */
+    OP_AND = '&', OP_OR = '|', OP_XOR = '^', OP_SHL = '<', OP_SHR = '>'
 };
 
+static const char* op_symbol(arith_op op) {
+    switch (op) {
+    case OP_SHL:
+        return "<<";
+    case OP_SHR:
+        return ">>";
+    case OP_PLUS:
+        return "+";
+    case OP_MINUS:
+        return "-";
+    case OP_DIV:
+        return "/";
+    case OP_MULT:
+        return "*";
+    case OP_AND:
+        return "&";
+    case OP_OR:
+        return "|";
+    case OP_XOR:
+        return "^";
+    case OP_NONE:
+        break;
+    }
+    return "=";
+}
+
 /* A single node in an expression tree.  "val_left" and "val_right"
  * point to the *value* of an expression, which can be used for lookups. */
 struct expr_node {
@@ -38,28 +101,262 @@ struct expr_node {
     arith_op op;
 };
 
-/* Minimum shortest-known expression for the goal.
- * Initialized by a very rough upper bound */
-static size_t goal_seen_n_terms = goal + 10;
+/* Rational mode.  With '--rational D', values may be any fraction p/q with
+ * 1 <= q <= D.  Each of them is stored as the single number p*D + (q-1),
+ * so the lists, levels and lookups keep working on plain integers, and the
+ * lattice stays dense.  With D == 1 this is exactly the integer mode. */
+static arith_t denominators = 1;
+/* Keeps all intermediate products within 'arith_t'. */
+static const arith_t max_denominators = 1000;
+
+static inline arith_t encode(arith_t p, arith_t q) {
+    return p * denominators + (q - 1);
+}
+
+static inline void decode(arith_t key, arith_t& p, arith_t& q) {
+    /* Round towards negative infinity, so the slot is never negative. */
+    p = key / denominators;
+    arith_t slot = key % denominators;
+    if (slot < 0) {
+        p -= 1;
+        slot += denominators;
+    }
+    q = slot + 1;
+}
+
+static arith_t gcd(arith_t a, arith_t b) {
+    while (b != 0) {
+        arith_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+/* Reduce p/q and encode it, unless the denominator is still too big or
+ * the value isn't relevant.  'q' must be positive. */
+static bool encode_reduced(arith_t p, arith_t q, arith_t& key) {
+    arith_t g = gcd(labs(p), q);
+    p /= g;
+    q /= g;
+    if (q > denominators || labs(p) >= max_relevant * q) {
+        return false;
+    }
+    key = encode(p, q);
+    return true;
+}
+
+static bool combine_rational(arith_op op, arith_t a_key, arith_t b_key,
+                             arith_t& key) {
+    arith_t ap, aq, bp, bq;
+    decode(a_key, ap, aq);
+    decode(b_key, bp, bq);
+    switch (op) {
+    case OP_PLUS:
+        return encode_reduced(ap * bq + bp * aq, aq * bq, key);
+    case OP_MINUS:
+        return encode_reduced(ap * bq - bp * aq, aq * bq, key);
+    case OP_MULT:
+        return encode_reduced(ap * bp, aq * bq, key);
+    case OP_DIV:
+        if (bp == 0) {
+            return false;
+        }
+        return encode_reduced(bp < 0 ? -ap * bq : ap * bq, labs(bp) * aq, key);
+    default:
+        break;
+    }
+    assert(false);
+    return false;
+}
+
+/* Word mode.  With '--word W', values are W-bit machine words: everything
+ * wraps around, nothing is ever too big, and the bitwise operators and
+ * shifts join in.  This is meant for finding short instruction sequences
+ * for constants.  The whole domain is finite, so which values are closed
+ * is tracked in a dense bitset with one bit per value; see 'word_kernel'. */
+static unsigned word_bits = 0; /* 0 means off. */
+static uint32_t word_mask = 0;
+
+/* The key of a plain integer (the goal, or an operand) in the current mode. */
+static arith_t key_of(arith_t value) {
+    if (word_bits != 0) {
+        return static_cast<arith_t>(static_cast<uint32_t>(value) & word_mask);
+    }
+    return encode(value, 1);
+}
+
+static void print_value(arith_t key) {
+    if (word_bits != 0) {
+        std::cout << "0x" << std::hex << key << std::dec;
+        return;
+    }
+    arith_t p, q;
+    decode(key, p, q);
+    std::cout << p;
+    if (q != 1) {
+        std::cout << "/" << q;
+    }
+}
+
+/* The three places where the bound for the goal prunes work, see README.
+ * Each can be switched off for A/B runs.  That only costs time (and
+ * memory), the resulting expression is just as short. */
+static bool prune_recache = true;
+static bool prune_discover = true;
+static bool prune_loop = true;
+
+/* What each rule saved, for one level of expanded nodes. */
+struct prune_stats_t {
+    size_t expanded = 0;
+    /* 'discover': candidates rejected, and whole pairs never generated. */
+    size_t rejected = 0;
+    size_t pairs_skipped = 0;
+    /* 'step_recache': open entries erased before reaching this level. */
+    size_t erased = 0;
+    /* Loop condition: open entries that never got expanded. */
+    size_t left_open = 0;
+};
+
+/* Memory for the search state.  It's handed out from a few big chunks,
+ * and small blocks (i.e. hash nodes) are recycled through per-size free
+ * lists.  Nothing goes back to the system until the arena is destroyed,
+ * which then takes one 'free' per chunk instead of one per node. */
+class arena_t {
+    static const size_t first_chunk = 64 << 10;
+    static const size_t max_chunk = 64 << 20;
+    /* Blocks up to 'granule * n_classes' bytes get recycled.  Bigger ones
+     * (bucket arrays) are rare enough to just wait for the end. */
+    static const size_t granule = 16;
+    static const size_t n_classes = 64;
+
+    std::vector<void*> chunks;
+    char* pos = nullptr;
+    size_t left = 0;
+    size_t next_chunk = first_chunk;
+    void* free_lists[n_classes] = {};
+
+    static size_t round_up(size_t size) {
+        return (size + granule - 1) / granule * granule;
+    }
+
+    void grow(size_t at_least) {
+        size_t size = std::max(next_chunk, at_least);
+        void* chunk = malloc(size);
+        if (chunk == nullptr) {
+            throw std::bad_alloc();
+        }
+        chunks.push_back(chunk);
+        pos = static_cast<char*>(chunk);
+        left = size;
+        if (next_chunk < max_chunk) {
+            next_chunk *= 2;
+        }
+    }
+
+public:
+    arena_t() = default;
+    arena_t(const arena_t&) = delete;
+    arena_t& operator=(const arena_t&) = delete;
+
+    ~arena_t() {
+        for (void* chunk : chunks) {
+            free(chunk);
+        }
+    }
+
+    void* allocate(size_t size) {
+        size = round_up(size);
+        size_t cls = size / granule - 1;
+        if (cls < n_classes && free_lists[cls] != nullptr) {
+            void* block = free_lists[cls];
+            free_lists[cls] = *static_cast<void**>(block);
+            return block;
+        }
+        if (size > left) {
+            grow(size);
+        }
+        void* block = pos;
+        pos += size;
+        left -= size;
+        return block;
+    }
+
+    void deallocate(void* block, size_t size) {
+        size_t cls = round_up(size) / granule - 1;
+        if (cls < n_classes) {
+            *static_cast<void**>(block) = free_lists[cls];
+            free_lists[cls] = block;
+        }
+    }
+
+    /* Construct a 'T' inside the arena.  Its destructor never runs, so it
+     * must not own anything outside of the arena. */
+    template <typename T, typename... Args>
+    T& create(Args&&... args) {
+        return *new (allocate(sizeof(T))) T(std::forward<Args>(args)...);
+    }
+};
+
+template <typename T>
+struct arena_allocator {
+    typedef T value_type;
+    arena_t* arena;
+
+    explicit arena_allocator(arena_t* arena) : arena(arena) {
+    }
+
+    template <typename U>
+    arena_allocator(const arena_allocator<U>& other) : arena(other.arena) {
+    }
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(arena->allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T* block, size_t n) {
+        arena->deallocate(block, n * sizeof(T));
+    }
+};
+
+template <typename T, typename U>
+static bool operator==(const arena_allocator<T>& a, const arena_allocator<U>& b) {
+    return a.arena == b.arena;
+}
+
+template <typename T, typename U>
+static bool operator!=(const arena_allocator<T>& a, const arena_allocator<U>& b) {
+    return a.arena != b.arena;
+}
 
 /* Need value->struct lookup. */
-typedef std::unordered_map<arith_t, expr_node> list_closed_t;
+typedef std::unordered_map<arith_t, expr_node, std::hash<arith_t>,
+                           std::equal_to<arith_t>,
+                           arena_allocator<std::pair<const arith_t, expr_node> > >
+    list_closed_t;
 
 /* Need value->n_terms insertion/update; min(n_terms) pop; min(n_terms) update.
  * That's an unusual set of requirements, so implement my own class.
  * Note that there's many ways to implement this. */
 class list_open_t {
     /* All elements with "min(n_terms)". */
-    typedef std::stack<arith_t> min_nterms_t;
+    typedef std::stack<arith_t, std::vector<arith_t, arena_allocator<arith_t> > >
+        min_nterms_t;
     min_nterms_t min_nterms_cached;
     size_t min_nterms = 0;
     /* Keeps track of the actual elements. */
-    typedef std::unordered_map<arith_t, expr_node> backing_t;
+    typedef list_closed_t backing_t;
     backing_t backing;
+    bool verbose = true;
+    /* Indexed by 'min_nterms', for the pruning report. */
+    std::vector<size_t, arena_allocator<size_t> > erased_per_level;
 
-    void step_recache() {
+    /* 'bound' is the solver's 'goal_seen_n_terms': anything at or beyond it
+     * is useless, except for the goal itself, i.e. 'keep'. */
+    void step_recache(size_t bound, arith_t keep) {
         min_nterms += 1;
-        assert(min_nterms <= goal_seen_n_terms);
+        assert(min_nterms <= bound || !prune_discover);
+        size_t erased = 0;
 
         /* Need to manually manage iterator,
          * as the erasing would invalidate it. */
@@ -73,26 +370,54 @@ class list_open_t {
             assert(entry.second.n_terms >= min_nterms);
             if (entry.second.n_terms == min_nterms) {
                 min_nterms_cached.push(entry.first);
-            } else if (entry.second.n_terms >= goal_seen_n_terms
-                    && entry.first != goal) {
+            } else if (entry.second.n_terms >= bound
+                    && entry.first != keep) {
                 /* This invalidates the reference! */
                 backing.erase(old_it);
+                ++erased;
             }
         }
-        std::cout << "Now at level " << min_nterms << " (" << size()
-            << " open, " << level_size() << " of that on current level)"
-            << std::endl;
+        if (erased_per_level.size() <= min_nterms) {
+            erased_per_level.resize(min_nterms + 1);
+        }
+        erased_per_level[min_nterms] += erased;
+        if (verbose) {
+            std::cout << "Now at level " << min_nterms << " (" << size()
+                << " open, " << level_size() << " of that on current level)"
+                << std::endl;
+        }
     }
 
-    void recache() {
+    void recache(size_t bound, arith_t keep) {
         assert(backing.size() > 0);
         assert(min_nterms_cached.size() == 0);
         do {
-            step_recache();
+            step_recache(bound, keep);
         } while (min_nterms_cached.size() == 0);
     }
 
 public:
+    /* All memory comes from 'arena', see 'solver'. */
+    explicit list_open_t(arena_t* arena)
+        : min_nterms_cached(arena_allocator<arith_t>(arena)),
+          backing(backing_t::allocator_type(arena)),
+          erased_per_level(arena_allocator<size_t>(arena)) {
+    }
+
+    list_open_t(const list_open_t& other, arena_t* arena)
+        : min_nterms_cached(other.min_nterms_cached,
+                            arena_allocator<arith_t>(arena)),
+          min_nterms(other.min_nterms),
+          backing(other.backing, backing_t::allocator_type(arena)),
+          verbose(other.verbose),
+          erased_per_level(other.erased_per_level,
+                           arena_allocator<size_t>(arena)) {
+    }
+
+    void set_verbose(bool enable) {
+        verbose = enable;
+    }
+
     /* Insert the given node. */
     void push(arith_t val, const expr_node& node) {
         assert(node.n_terms >= 1);
@@ -116,17 +441,28 @@ public:
         return min_nterms_cached.size();
     }
 
+    size_t erased_at(size_t level) const {
+        return level < erased_per_level.size() ? erased_per_level[level] : 0;
+    }
+
     size_t size() const {
         return backing.size();
     }
 
-    /* Remove some node with the smallest 'n_terms'
-     * and return the removed node. */
-    void pop_into(arith_t& into_val, expr_node& into_node) {
+    /* The smallest 'n_terms' of any node, i.e. what 'pop_into' would get. */
+    size_t peek_n_terms(size_t bound, arith_t keep) {
         assert(size() != 0);
         if (min_nterms_cached.size() == 0) {
-            recache();
+            recache(bound, keep);
         }
+        return min_nterms;
+    }
+
+    /* Remove some node with the smallest 'n_terms'
+     * and return the removed node. */
+    void pop_into(arith_t& into_val, expr_node& into_node,
+                  size_t bound, arith_t keep) {
+        peek_n_terms(bound, keep);
         into_val = min_nterms_cached.top();
         min_nterms_cached.pop();
         backing_t::iterator it = backing.find(into_val);
@@ -136,145 +472,1962 @@ public:
         backing.erase(it);
     }
 
-    const expr_node& at(arith_t val) {
+    const expr_node& at(arith_t val) const {
         return backing.at(val);
     }
+
+    /* Null if there's no node for 'val'. */
+    const expr_node* find(arith_t val) const {
+        backing_t::const_iterator it = backing.find(val);
+        return it == backing.end() ? nullptr : &it->second;
+    }
 };
 
-/* Search state.  Invariants:
- * - 'list_open' and 'list_closed' contain nodes for mutually exclusive
- *   sets of values
- * - the nodes in 'list_closed' can only be combined in ways that generate
- *   values for which we already have a node in either list.
- * - a node in 'list_closed' represents an expression of minimum 'n_terms'. */
-static list_closed_t list_closed;
-static list_open_t list_open;
+/* One level of closed values, see 'solver::closed_levels'. */
+typedef std::vector<arith_t> closed_level_t;
+/* The same in word mode, see 'solver::word_levels'. */
+typedef std::vector<uint32_t> word_level_t;
+
+/* Which of the candidates of a pair lie within 'max_relevant'.
+ * Division always shrinks the value, so it doesn't need a bit. */
+enum range_bit : unsigned char {
+    RANGE_PLUS = 1, RANGE_MINUS = 2, RANGE_MINUS_REV = 4, RANGE_MULT = 8
+};
 
-static const expr_node& lookup_best_known(arith_t val) {
-    list_closed_t::const_iterator it = list_closed.find(val);
-    if (it != list_closed.end()) {
-        return it->second;
+/* Same as 'labs(val) < max_relevant', but without branches. */
+static inline bool is_relevant(arith_t val) {
+    return static_cast<unsigned long>(val + (max_relevant - 1))
+        < static_cast<unsigned long>(2 * max_relevant - 1);
+}
+
+/* The 'range_bit's of the pair 'a', 'b'.  Note that 'a*b' can't overflow,
+ * as both are relevant. */
+static inline __attribute__((always_inline))
+unsigned char range_flags(arith_t a, arith_t b) {
+    return static_cast<unsigned char>(
+          (is_relevant(a + b) ? RANGE_PLUS : 0)
+        | (is_relevant(a - b) ? RANGE_MINUS : 0)
+        | (is_relevant(b - a) ? RANGE_MINUS_REV : 0)
+        | (is_relevant(a * b) ? RANGE_MULT : 0));
+}
+
+/* Range filtering for a whole level of peers at once.  This saves 'discover'
+ * from looking up hopeless values, and is written such that the compiler
+ * can vectorize it. */
+static inline __attribute__((always_inline))
+void range_kernel_body(arith_t a, const arith_t* peers, size_t n,
+                       unsigned char* in_range) {
+    for (size_t i = 0; i < n; ++i) {
+        in_range[i] = range_flags(a, peers[i]);
     }
-    return list_open.at(val);
 }
 
-static void print_expr(arith_t val) {
-    const expr_node& node = lookup_best_known(val);
-    if (node.op == OP_NONE) {
-        std::cout << val;
-    } else {
-        std::cout << "(";
-        print_expr(node.val_left);
-        /* Evil hack: '.op' is both an enum
-         * *and* the representing character. */
-        std::cout << static_cast<char>(node.op);
-        print_expr(node.val_right);
-        std::cout << ")";
+/* Decoding for 'packed_level_t', fused with the range check: each value is
+ * 'base' plus an unsigned offset of type 'T', so decoding is one widening
+ * load and one addition per lane, and the flags are computed right from
+ * that register.  The values are stored as well, 'generate_against' needs
+ * them; that buffer is a single block, so it never leaves L1. */
+template <typename T>
+static inline __attribute__((always_inline))
+void packed_kernel_lanes(arith_t a, arith_t base, const T* offsets, size_t n,
+                         arith_t* peers, unsigned char* in_range) {
+    for (size_t i = 0; i < n; ++i) {
+        arith_t b = base + static_cast<arith_t>(offsets[i]);
+        peers[i] = b;
+        in_range[i] = range_flags(a, b);
     }
 }
 
-static void provide(arith_t d) {
-    expr_node node = {.n_terms = 1, .val_left = d, .val_right = d,
-                      .op = OP_NONE};
-    list_open.push(d, node);
+/* 'offsets' points to 'n' offsets of 'width' bits, see 'packed_level_t'. */
+static inline __attribute__((always_inline))
+void packed_kernel_body(arith_t a, arith_t base, const void* offsets,
+                        unsigned width, size_t n, arith_t* peers,
+                        unsigned char* in_range) {
+    switch (width) {
+    case 8:
+        packed_kernel_lanes(a, base, static_cast<const uint8_t*>(offsets),
+                            n, peers, in_range);
+        break;
+    case 16:
+        packed_kernel_lanes(a, base, static_cast<const uint16_t*>(offsets),
+                            n, peers, in_range);
+        break;
+    case 32:
+        packed_kernel_lanes(a, base, static_cast<const uint32_t*>(offsets),
+                            n, peers, in_range);
+        break;
+    default:
+        packed_kernel_lanes(a, base, static_cast<const uint64_t*>(offsets),
+                            n, peers, in_range);
+        break;
+    }
 }
 
-static void discover(arith_t val, const expr_node& node) {
-    /* Only add to open list if not already known in closed list.
-     * (Avoid rediscovering easily-generated values like 0 or 1.) */
-    if (list_closed.count(val) != 0) {
-        return;
+/* All results of 'a op b' in word mode, for a tile of peers.  The reversed
+ * operators are only needed if 'a != b'; 'generate_words' skips them then. */
+struct word_op_t {
+    arith_op op;
+    bool reversed;
+};
+
+static const word_op_t word_ops[] = {
+    {OP_PLUS, false}, {OP_MULT, false}, {OP_AND, false}, {OP_OR, false},
+    {OP_XOR, false}, {OP_MINUS, false}, {OP_SHL, false}, {OP_SHR, false},
+    {OP_MINUS, true}, {OP_SHL, true}, {OP_SHR, true},
+};
+static const size_t n_word_ops = sizeof(word_ops) / sizeof(word_ops[0]);
+
+/* Computes result 'k' for peer 'i' into 'out[k * n + i]', and probes the
+ * closed bitset for it right away, so only 'unseen' ones go to 'discover'.
+ * Shift counts wrap at the word size, as on real hardware.  One loop per
+ * operator keeps each of them a plain lane-wise map plus a 32-bit gather,
+ * which is what lets them vectorize. */
+template <typename Op>
+static inline __attribute__((always_inline))
+void word_op_lanes(Op op, const uint32_t* __restrict__ peers, size_t n,
+                   const uint32_t* __restrict__ closed,
+                   uint32_t* __restrict__ out,
+                   unsigned char* __restrict__ unseen) {
+    for (size_t i = 0; i < n; ++i) {
+        uint32_t v = op(peers[i]);
+        out[i] = v;
+        unseen[i] = !((closed[v >> 5] >> (v & 31)) & 1);
     }
-    arith_t abs_val = labs(val);
-    if (abs_val >= max_relevant) {
-        return;
+}
+
+static inline __attribute__((always_inline))
+void word_kernel_body(uint32_t a, const uint32_t* peers, size_t n,
+                      const uint32_t* closed, uint32_t* out,
+                      unsigned char* unseen) {
+    uint32_t mask = word_mask;
+    uint32_t shift_mask = word_bits - 1;
+    uint32_t a_shift = a & shift_mask;
+    word_op_lanes([=](uint32_t b) { return (a + b) & mask; },
+                  peers, n, closed, out + 0 * n, unseen + 0 * n);
+    word_op_lanes([=](uint32_t b) { return (a * b) & mask; },
+                  peers, n, closed, out + 1 * n, unseen + 1 * n);
+    word_op_lanes([=](uint32_t b) { return a & b; },
+                  peers, n, closed, out + 2 * n, unseen + 2 * n);
+    word_op_lanes([=](uint32_t b) { return a | b; },
+                  peers, n, closed, out + 3 * n, unseen + 3 * n);
+    word_op_lanes([=](uint32_t b) { return a ^ b; },
+                  peers, n, closed, out + 4 * n, unseen + 4 * n);
+    word_op_lanes([=](uint32_t b) { return (a - b) & mask; },
+                  peers, n, closed, out + 5 * n, unseen + 5 * n);
+    word_op_lanes([=](uint32_t b) { return (a << (b & shift_mask)) & mask; },
+                  peers, n, closed, out + 6 * n, unseen + 6 * n);
+    word_op_lanes([=](uint32_t b) { return a >> (b & shift_mask); },
+                  peers, n, closed, out + 7 * n, unseen + 7 * n);
+    word_op_lanes([=](uint32_t b) { return (b - a) & mask; },
+                  peers, n, closed, out + 8 * n, unseen + 8 * n);
+    word_op_lanes([=](uint32_t b) { return (b << a_shift) & mask; },
+                  peers, n, closed, out + 9 * n, unseen + 9 * n);
+    word_op_lanes([=](uint32_t b) { return b >> a_shift; },
+                  peers, n, closed, out + 10 * n, unseen + 10 * n);
+}
+
+/* One copy of each kernel per instruction set, chosen once at startup.
+ * Only the target attribute differs; the body gets inlined into each. */
+typedef void (*range_kernel_t)(arith_t, const arith_t*, size_t, unsigned char*);
+typedef void (*packed_kernel_t)(arith_t, arith_t, const void*, unsigned,
+                                size_t, arith_t*, unsigned char*);
+typedef void (*word_kernel_t)(uint32_t, const uint32_t*, size_t,
+                              const uint32_t*, uint32_t*, unsigned char*);
+
+static void range_kernel_generic(arith_t a, const arith_t* peers, size_t n,
+                                 unsigned char* in_range) {
+    range_kernel_body(a, peers, n, in_range);
+}
+
+static void packed_kernel_generic(arith_t a, arith_t base, const void* offsets,
+                                  unsigned width, size_t n, arith_t* peers,
+                                  unsigned char* in_range) {
+    packed_kernel_body(a, base, offsets, width, n, peers, in_range);
+}
+
+static void word_kernel_generic(uint32_t a, const uint32_t* peers, size_t n,
+                                const uint32_t* closed, uint32_t* out,
+                                unsigned char* unseen) {
+    word_kernel_body(a, peers, n, closed, out, unseen);
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define MINRPN_HAVE_X86_KERNELS 1
+__attribute__((target("sse4.2")))
+static void range_kernel_sse42(arith_t a, const arith_t* peers, size_t n,
+                               unsigned char* in_range) {
+    range_kernel_body(a, peers, n, in_range);
+}
+
+__attribute__((target("sse4.2")))
+static void packed_kernel_sse42(arith_t a, arith_t base, const void* offsets,
+                                unsigned width, size_t n, arith_t* peers,
+                                unsigned char* in_range) {
+    packed_kernel_body(a, base, offsets, width, n, peers, in_range);
+}
+
+__attribute__((target("sse4.2")))
+static void word_kernel_sse42(uint32_t a, const uint32_t* peers, size_t n,
+                              const uint32_t* closed, uint32_t* out,
+                              unsigned char* unseen) {
+    word_kernel_body(a, peers, n, closed, out, unseen);
+}
+
+__attribute__((target("avx2")))
+static void range_kernel_avx2(arith_t a, const arith_t* peers, size_t n,
+                              unsigned char* in_range) {
+    range_kernel_body(a, peers, n, in_range);
+}
+
+__attribute__((target("avx2")))
+static void packed_kernel_avx2(arith_t a, arith_t base, const void* offsets,
+                               unsigned width, size_t n, arith_t* peers,
+                               unsigned char* in_range) {
+    packed_kernel_body(a, base, offsets, width, n, peers, in_range);
+}
+
+__attribute__((target("avx2")))
+static void word_kernel_avx2(uint32_t a, const uint32_t* peers, size_t n,
+                             const uint32_t* closed, uint32_t* out,
+                             unsigned char* unseen) {
+    word_kernel_body(a, peers, n, closed, out, unseen);
+}
+
+__attribute__((target("avx512f,avx512dq,avx512bw,avx512vl")))
+static void range_kernel_avx512(arith_t a, const arith_t* peers, size_t n,
+                                unsigned char* in_range) {
+    range_kernel_body(a, peers, n, in_range);
+}
+
+__attribute__((target("avx512f,avx512dq,avx512bw,avx512vl")))
+static void packed_kernel_avx512(arith_t a, arith_t base, const void* offsets,
+                                 unsigned width, size_t n, arith_t* peers,
+                                 unsigned char* in_range) {
+    packed_kernel_body(a, base, offsets, width, n, peers, in_range);
+}
+
+__attribute__((target("avx512f,avx512dq,avx512bw,avx512vl")))
+static void word_kernel_avx512(uint32_t a, const uint32_t* peers, size_t n,
+                               const uint32_t* closed, uint32_t* out,
+                               unsigned char* unseen) {
+    word_kernel_body(a, peers, n, closed, out, unseen);
+}
+#endif
+
+struct isa_variant {
+    const char* name;
+    range_kernel_t range_kernel;
+    packed_kernel_t packed_kernel;
+    word_kernel_t word_kernel;
+};
+
+/* Ordered from best to worst, so the first supported one wins. */
+static const isa_variant isa_variants[] = {
+#ifdef MINRPN_HAVE_X86_KERNELS
+    {"avx512", range_kernel_avx512, packed_kernel_avx512, word_kernel_avx512},
+    {"avx2", range_kernel_avx2, packed_kernel_avx2, word_kernel_avx2},
+    {"sse4.2", range_kernel_sse42, packed_kernel_sse42, word_kernel_sse42},
+#endif
+    {"generic", range_kernel_generic, packed_kernel_generic, word_kernel_generic},
+};
+
+static range_kernel_t range_kernel = range_kernel_generic;
+static packed_kernel_t packed_kernel = packed_kernel_generic;
+static word_kernel_t word_kernel = word_kernel_generic;
+static const char* isa_name = "generic";
+
+/* How many peers are range-checked at once.  Tiles should fit into L1
+ * together with their flags, which is why this is tunable. */
+static size_t tile_size = 4096;
+
+static bool isa_supported(const isa_variant& variant) {
+#ifdef MINRPN_HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (!strcmp(variant.name, "avx512")) {
+        return __builtin_cpu_supports("avx512f")
+            && __builtin_cpu_supports("avx512dq")
+            && __builtin_cpu_supports("avx512bw")
+            && __builtin_cpu_supports("avx512vl");
+    } else if (!strcmp(variant.name, "avx2")) {
+        return __builtin_cpu_supports("avx2");
+    } else if (!strcmp(variant.name, "sse4.2")) {
+        return __builtin_cpu_supports("sse4.2");
     }
-    if (node.n_terms >= goal_seen_n_terms) {
-        /* Don't care about a node if it can't possibly yield a
-         * better expression. */
-        return;
+#endif
+    return !strcmp(variant.name, "generic");
+}
+
+/* Pick the kernels, either the best supported or the 'forced' ones.
+ * Returns false if 'forced' is unknown or not supported by this CPU. */
+static bool select_isa(const char* forced) {
+    for (const isa_variant& variant : isa_variants) {
+        if (forced != nullptr && strcmp(variant.name, forced)) {
+            continue;
+        }
+        if (!isa_supported(variant)) {
+            if (forced != nullptr) {
+                std::cerr << "This CPU doesn't support " << forced << std::endl;
+                return false;
+            }
+            continue;
+        }
+        range_kernel = variant.range_kernel;
+        packed_kernel = variant.packed_kernel;
+        word_kernel = variant.word_kernel;
+        isa_name = variant.name;
+        return true;
+    }
+    std::cerr << "Unknown instruction set " << forced << std::endl;
+    return false;
+}
+
+/* Compressed levels.  With '--compress', a level is packed as soon as the
+ * search has moved past it, as it never changes after that, but still gets
+ * walked for every single expansion.  Its values are sorted and split into
+ * blocks, each stored as the first value plus the offset of each value from
+ * it, using the smallest of 8, 16, 32 or 64 bits that fits.  Whole lanes
+ * keep the decoding vectorizable, see 'packed_kernel_body'.  n_terms is the
+ * same for the whole level, and the ops live in the lists, so there's
+ * nothing else to store. */
+static bool compress_levels = false;
+static const size_t block_size = 128;
+
+class packed_level_t {
+    struct block_t {
+        arith_t base;
+        size_t offset; /* Into the array for 'width'. */
+        unsigned width;
+    };
+    std::vector<block_t> blocks;
+    std::vector<uint8_t> offsets8;
+    std::vector<uint16_t> offsets16;
+    std::vector<uint32_t> offsets32;
+    std::vector<uint64_t> offsets64;
+    size_t count = 0;
+
+    template <typename T>
+    static void append(std::vector<T>& into, const arith_t* values, size_t n) {
+        for (size_t i = 0; i < n; ++i) {
+            into.push_back(static_cast<T>(values[i] - values[0]));
+        }
+    }
+
+    template <typename T>
+    static void widen(arith_t base, const T* offsets, size_t n, arith_t* out) {
+        for (size_t i = 0; i < n; ++i) {
+            out[i] = base + static_cast<arith_t>(offsets[i]);
+        }
+    }
+
+    const void* offsets_of(const block_t& block) const {
+        switch (block.width) {
+        case 8:
+            return offsets8.data() + block.offset;
+        case 16:
+            return offsets16.data() + block.offset;
+        case 32:
+            return offsets32.data() + block.offset;
+        default:
+            return offsets64.data() + block.offset;
+        }
+    }
+
+    size_t block_count(size_t b) const {
+        return std::min(block_size, count - b * block_size);
+    }
+
+public:
+    explicit packed_level_t(closed_level_t values) {
+        std::sort(values.begin(), values.end());
+        count = values.size();
+        for (size_t start = 0; start < count; start += block_size) {
+            size_t n = std::min(block_size, count - start);
+            const arith_t* block_values = values.data() + start;
+            /* Sorted, so all offsets are positive. */
+            uint64_t span = static_cast<uint64_t>(block_values[n - 1] - block_values[0]);
+            block_t block = {block_values[0], 0, 64};
+            if (span <= UINT8_MAX) {
+                block.width = 8;
+                block.offset = offsets8.size();
+                append(offsets8, block_values, n);
+            } else if (span <= UINT16_MAX) {
+                block.width = 16;
+                block.offset = offsets16.size();
+                append(offsets16, block_values, n);
+            } else if (span <= UINT32_MAX) {
+                block.width = 32;
+                block.offset = offsets32.size();
+                append(offsets32, block_values, n);
+            } else {
+                block.offset = offsets64.size();
+                append(offsets64, block_values, n);
+            }
+            blocks.push_back(block);
+        }
+        offsets8.shrink_to_fit();
+        offsets16.shrink_to_fit();
+        offsets32.shrink_to_fit();
+        offsets64.shrink_to_fit();
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    size_t n_blocks() const {
+        return blocks.size();
+    }
+
+    /* Decode block 'b' into 'out' (room for 'block_size' values),
+     * and return how many values it has. */
+    size_t unpack(size_t b, arith_t* out) const {
+        const block_t& block = blocks[b];
+        size_t n = block_count(b);
+        const void* offsets = offsets_of(block);
+        switch (block.width) {
+        case 8:
+            widen(block.base, static_cast<const uint8_t*>(offsets), n, out);
+            break;
+        case 16:
+            widen(block.base, static_cast<const uint16_t*>(offsets), n, out);
+            break;
+        case 32:
+            widen(block.base, static_cast<const uint32_t*>(offsets), n, out);
+            break;
+        default:
+            widen(block.base, static_cast<const uint64_t*>(offsets), n, out);
+            break;
+        }
+        return n;
+    }
+
+    /* Like 'unpack', and also range-check each value against 'a', in the
+     * same pass.  'in_range' needs room for 'block_size' flags.  Tuning
+     * passes in the 'kernel' it wants to time. */
+    size_t check(size_t b, arith_t a, arith_t* out, unsigned char* in_range,
+                 packed_kernel_t kernel = packed_kernel) const {
+        const block_t& block = blocks[b];
+        size_t n = block_count(b);
+        kernel(a, block.base, offsets_of(block), block.width, n, out, in_range);
+        return n;
+    }
+};
+
+/* Auto-tuning.  The best kernel variant and tile size depend on the CPU
+ * and its caches, so with '--tune' each candidate is timed on the values of
+ * the first levels, and the fastest one is kept for the rest of the run.
+ * What gets timed is the kernel the current mode actually runs, see
+ * 'solver::tune'.  With '--profile' the choice is cached, so each host only
+ * tunes once. */
+static const size_t tune_level = 5;
+static const size_t tune_tiles[] = {256, 1024, 4096, 16384};
+static bool tune_pending = false;
+static bool isa_forced = false;
+static const char* profile_path = nullptr;
+static volatile size_t tune_sink; /* Keeps the timed work from being elided. */
+
+/* Each measurement repeats the sweep for at least this long, so timer
+ * resolution and scheduling hiccups don't decide.  The best and worst of
+ * 'tune_reps' measurements tell how noisy this host is. */
+static const double tune_budget = 0.004; /* Seconds. */
+static const int tune_reps = 5;
+/* A candidate must beat the default by this much, plus the noise. */
+static const double tune_margin = 0.05;
+
+struct timing_t {
+    double best = HUGE_VAL;
+    double worst = 0;
+};
+
+/* Seconds per call of 'sweep', which returns something to keep alive. */
+template <typename F>
+static timing_t time_candidate(F&& sweep) {
+    timing_t timing;
+    for (int rep = 0; rep < tune_reps; ++rep) {
+        std::chrono::steady_clock::time_point begin =
+            std::chrono::steady_clock::now();
+        std::chrono::duration<double> took(0);
+        size_t calls = 0;
+        while (took.count() < tune_budget) {
+            tune_sink = sweep();
+            ++calls;
+            took = std::chrono::steady_clock::now() - begin;
+        }
+        double per_call = took.count() / calls;
+        timing.best = std::min(timing.best, per_call);
+        timing.worst = std::max(timing.worst, per_call);
+    }
+    return timing;
+}
+
+/* Fills 'peers' with all values of 'levels', repeated up to the size the
+ * later levels will have, as the first ones are tiny.  A few of them go to
+ * 'as', to serve as the expanded nodes.  False if there are no values. */
+template <typename Level>
+static bool tune_sample(const std::vector<Level>& levels, Level& as, Level& peers) {
+    for (const Level& level : levels) {
+        peers.insert(peers.end(), level.begin(), level.end());
+    }
+    if (peers.empty()) {
+        return false;
     }
-    list_open.push(val, node);
-    if (val == goal) {
-        goal_seen_n_terms = node.n_terms;
-        std::cout << "One way (" << node.n_terms << " terms) = ";
-        print_expr(goal);
-        std::cout << std::endl;
+    for (size_t i = 0; i < 16; ++i) {
+        as.push_back(peers[(i * 7919) % peers.size()]);
+    }
+    while (peers.size() < 16384) {
+        /* Not 'insert' from itself, that's undefined. */
+        size_t n = peers.size();
+        peers.reserve(2 * n);
+        for (size_t i = 0; i < n; ++i) {
+            peers.push_back(peers[i]);
+        }
     }
+    return true;
+}
+
+static timing_t time_range_kernel(range_kernel_t kernel, size_t tile,
+                                  const closed_level_t& as,
+                                  const closed_level_t& peers) {
+    std::vector<unsigned char> in_range(tile);
+    return time_candidate([&]() {
+        size_t hits = 0;
+        for (arith_t a : as) {
+            for (size_t start = 0; start < peers.size(); start += tile) {
+                size_t n = std::min(tile, peers.size() - start);
+                kernel(a, peers.data() + start, n, in_range.data());
+                /* Stand-in for 'generate_against' reading the flags. */
+                for (size_t i = 0; i < n; ++i) {
+                    hits += in_range[i] != 0;
+                }
+            }
+        }
+        return hits;
+    });
+}
+
+/* Like 'time_range_kernel', but decoding 'peers' as 'for_each_tile' does. */
+static timing_t time_packed_kernel(packed_kernel_t kernel, size_t tile,
+                                   const closed_level_t& as,
+                                   const packed_level_t& peers) {
+    size_t per_tile = std::max<size_t>(tile / block_size, 1);
+    closed_level_t unpacked(per_tile * block_size);
+    std::vector<unsigned char> in_range(per_tile * block_size);
+    return time_candidate([&]() {
+        size_t hits = 0;
+        for (arith_t a : as) {
+            for (size_t b = 0; b < peers.n_blocks(); b += per_tile) {
+                size_t last = std::min(b + per_tile, peers.n_blocks());
+                size_t n = 0;
+                for (size_t c = b; c < last; ++c) {
+                    n += peers.check(c, a, unpacked.data() + n,
+                                     in_range.data() + n, kernel);
+                }
+                for (size_t i = 0; i < n; ++i) {
+                    hits += in_range[i] != 0;
+                }
+            }
+        }
+        return hits;
+    });
+}
+
+/* Like 'time_range_kernel', for word mode against the 'closed' bitset. */
+static timing_t time_word_kernel(word_kernel_t kernel, size_t tile,
+                                 const word_level_t& as,
+                                 const word_level_t& peers,
+                                 const uint32_t* closed) {
+    std::vector<uint32_t> out(n_word_ops * tile);
+    std::vector<unsigned char> unseen(n_word_ops * tile);
+    return time_candidate([&]() {
+        size_t hits = 0;
+        for (uint32_t a : as) {
+            for (size_t start = 0; start < peers.size(); start += tile) {
+                size_t n = std::min(tile, peers.size() - start);
+                kernel(a, peers.data() + start, n, closed, out.data(),
+                       unseen.data());
+                /* Stand-in for 'generate_words' reading the flags. */
+                for (size_t i = 0; i < n_word_ops * n; ++i) {
+                    hits += unseen[i];
+                }
+            }
+        }
+        return hits;
+    });
 }
 
-static void generate_against(arith_t a_val, const expr_node& a, arith_t b_val, const expr_node& b) {
-    expr_node node;
-    node.n_terms = a.n_terms + b.n_terms;
-    assert(node.n_terms >= 2);
+static void write_profile() {
+    std::ofstream out(profile_path);
+    out << "isa " << isa_name << "\ntile " << tile_size << "\n";
+    if (!out) {
+        std::cerr << "Can't write profile " << profile_path << std::endl;
+    }
+}
 
-    node.val_left = a_val;
-    node.val_right = b_val;
-    if (b_val != 0 && a_val % b_val == 0) {
-        node.op = OP_DIV;   discover(a_val / b_val, node);
+/* Returns false if there's no usable profile, so tuning is needed. */
+static bool read_profile() {
+    std::ifstream in(profile_path);
+    std::string key, name;
+    size_t tile = 0;
+    if (!(in >> key >> name) || key != "isa"
+            || !(in >> key >> tile) || key != "tile") {
+        return false;
+    }
+    /* Only what '--tune' could have picked, anything else is corrupt. */
+    if (std::find(std::begin(tune_tiles), std::end(tune_tiles), tile)
+            == std::end(tune_tiles)) {
+        std::cerr << "Ignoring profile " << profile_path
+            << ": bad tile size " << tile << std::endl;
+        return false;
+    }
+    if (!isa_forced && !select_isa(name.c_str())) {
+        return false;
     }
-    node.op = OP_MINUS; discover(a_val - b_val, node);
-    node.op = OP_MULT ; discover(a_val * b_val, node);
-    node.op = OP_PLUS ; discover(a_val + b_val, node);
+    tile_size = tile;
+    std::cout << "Loaded profile " << profile_path << ": " << isa_name
+        << " kernels, tile size " << tile_size << "." << std::endl;
+    return true;
+}
 
-    /* Try to avoid needless duplicates */
-    if (b_val != a_val) {
-        node.val_left = b_val;
-        node.val_right = a_val;
-        if (a_val != 0 && b_val % a_val == 0) {
-            node.op = OP_DIV;   discover(b_val / a_val, node);
+/* Picks the fastest variant and tile size.  'time_variant(variant, tile)'
+ * times one candidate on the kernel the current mode runs. */
+template <typename F>
+static void calibrate(F&& time_variant) {
+    /* The default is what 'select_isa' picked, with the default tile size.
+     * Only leave it for a candidate that's clearly faster, otherwise noise
+     * would pick a different winner every time. */
+    const isa_variant* best_variant = nullptr;
+    for (const isa_variant& variant : isa_variants) {
+        if (variant.range_kernel == range_kernel) {
+            best_variant = &variant;
+        }
+    }
+    assert(best_variant != nullptr);
+    size_t best_tile = tile_size;
+    timing_t fallback = time_variant(*best_variant, tile_size);
+    double noise = (fallback.worst - fallback.best) / fallback.best;
+    double best = fallback.best * (1 - tune_margin - noise);
+    for (const isa_variant& variant : isa_variants) {
+        if ((isa_forced && variant.range_kernel != range_kernel)
+                || !isa_supported(variant)) {
+            continue;
+        }
+        for (size_t tile : tune_tiles) {
+            timing_t took = time_variant(variant, tile);
+            if (took.best < best) {
+                best = took.best;
+                best_variant = &variant;
+                best_tile = tile;
+            }
         }
-        node.op = OP_MINUS; discover(b_val - a_val, node);
+    }
+
+    range_kernel = best_variant->range_kernel;
+    packed_kernel = best_variant->packed_kernel;
+    word_kernel = best_variant->word_kernel;
+    isa_name = best_variant->name;
+    tile_size = best_tile;
+    std::cout << "Tuned: " << isa_name << " kernels, tile size "
+        << tile_size << "." << std::endl;
+    if (profile_path != nullptr) {
+        write_profile();
     }
 }
 
-int main() {
-    /* Tweak this if you feel like it. */
-    provide(69);
-    provide(420);
+/* Monitoring.  Long runs can expose their progress as Prometheus metrics
+ * over HTTP, see '--metrics-port' and '--metrics-socket'.  The search loop
+ * only does relaxed atomic updates; everything else happens whenever the
+ * server thread gets scraped.  Rates like pairs per second are left to
+ * Prometheus, as usual for counters. */
+struct metrics_t {
+    std::atomic<size_t> level{0};
+    std::atomic<size_t> open_size{0};
+    std::atomic<size_t> closed_size{0};
+    std::atomic<size_t> goal_bound{0};
+    std::atomic<size_t> solves_active{0};
+    std::atomic<unsigned long> expansions{0};
+    std::atomic<unsigned long> pairs{0};
+    std::atomic<unsigned long> bound_improvements{0};
+    std::atomic<unsigned long> solves_finished{0};
+};
+static metrics_t metrics;
+static pthread_t search_thread;
 
-    /* Did you provide at least one value? */
-    assert(list_open.size() > 0);
+static void write_metric(std::ostream& out, const char* name,
+                         const char* type, const char* help, double value) {
+    out << "# HELP " << name << " " << help << "\n"
+        << "# TYPE " << name << " " << type << "\n"
+        << name << " " << value << "\n";
+}
 
-    /* Search */
+/* Returns a negative value if the clock can't be read. */
+static double thread_cpu_seconds(pthread_t thread) {
+    clockid_t clock;
+    timespec ts;
+    if (pthread_getcpuclockid(thread, &clock) || clock_gettime(clock, &ts)) {
+        return -1;
+    }
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static std::string render_metrics() {
+    std::memory_order relaxed = std::memory_order_relaxed;
+    std::ostringstream out;
+    out << std::setprecision(15);
+    write_metric(out, "minrpn_level", "gauge",
+        "Term count of the most recently expanded node.",
+        metrics.level.load(relaxed));
+    write_metric(out, "minrpn_open_nodes", "gauge",
+        "Size of the open list.", metrics.open_size.load(relaxed));
+    write_metric(out, "minrpn_closed_nodes", "gauge",
+        "Size of the closed list.", metrics.closed_size.load(relaxed));
+    write_metric(out, "minrpn_goal_bound_terms", "gauge",
+        "Shortest known expression for the goal, or the initial bound.",
+        metrics.goal_bound.load(relaxed));
+    write_metric(out, "minrpn_bound_improvements_total", "counter",
+        "How often a shorter expression for the goal was found.",
+        metrics.bound_improvements.load(relaxed));
+    write_metric(out, "minrpn_expansions_total", "counter",
+        "Nodes moved from the open to the closed list.",
+        metrics.expansions.load(relaxed));
+    write_metric(out, "minrpn_pairs_total", "counter",
+        "Pairs of closed nodes generated against each other.",
+        metrics.pairs.load(relaxed));
+    write_metric(out, "minrpn_solves_active", "gauge",
+        "Solves still running in batch mode.",
+        metrics.solves_active.load(relaxed));
+    write_metric(out, "minrpn_solves_finished_total", "counter",
+        "Solves finished in batch mode.",
+        metrics.solves_finished.load(relaxed));
+
+    /* Linux only, so just leave it out elsewhere. */
+    std::ifstream statm("/proc/self/statm");
+    unsigned long pages_total, pages_resident;
+    if (statm >> pages_total >> pages_resident) {
+        write_metric(out, "minrpn_resident_memory_bytes", "gauge",
+            "Resident set size of the process.",
+            static_cast<double>(pages_resident) * sysconf(_SC_PAGESIZE));
+    }
+
+    out << "# HELP minrpn_thread_cpu_seconds_total"
+           " CPU time used by each thread.\n"
+        << "# TYPE minrpn_thread_cpu_seconds_total counter\n";
+    double search_cpu = thread_cpu_seconds(search_thread);
+    double metrics_cpu = thread_cpu_seconds(pthread_self());
+    if (search_cpu >= 0) {
+        out << "minrpn_thread_cpu_seconds_total{thread=\"search\"} "
+            << search_cpu << "\n";
+    }
+    if (metrics_cpu >= 0) {
+        out << "minrpn_thread_cpu_seconds_total{thread=\"metrics\"} "
+            << metrics_cpu << "\n";
+    }
+    return out.str();
+}
+
+/* Answers every connection with the metrics, whatever the request was. */
+static void serve_metrics(int listen_fd) {
+    for (;;) {
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0) {
+            /* Retry the harmless ones right away.  Anything else, like being
+             * out of file descriptors, won't go away soon, and spinning on it
+             * would steal a core from the search. */
+            if (errno != EINTR && errno != ECONNABORTED) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            }
+            continue;
+        }
+        /* Don't let a silent client block the server forever. */
+        timeval timeout = {1, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        char request[1024];
+        if (recv(fd, request, sizeof(request), 0) < 0) {
+            close(fd);
+            continue;
+        }
+
+        std::string body = render_metrics();
+        std::ostringstream response;
+        response << "HTTP/1.0 200 OK\r\n"
+                    "Content-Type: text/plain; version=0.0.4\r\n"
+                    "Content-Length: " << body.size() << "\r\n\r\n" << body;
+        std::string data = response.str();
+        const char* pos = data.data();
+        size_t left = data.size();
+        while (left > 0) {
+            ssize_t sent = send(fd, pos, left, MSG_NOSIGNAL);
+            if (sent <= 0) {
+                break;
+            }
+            pos += sent;
+            left -= static_cast<size_t>(sent);
+        }
+        close(fd);
+    }
+}
+
+/* Set once the socket is bound, so 'fast_exit' can remove it again. */
+static const char* metrics_socket_path = nullptr;
+
+/* Exactly one of 'port' and 'socket_path' should be given.
+ * Returns false if the socket can't be set up. */
+static bool start_metrics(unsigned short port, const char* socket_path) {
+    int fd;
+    if (socket_path != nullptr) {
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+            std::cerr << "Socket path too long: " << socket_path << std::endl;
+            return false;
+        }
+        strcpy(addr.sun_path, socket_path);
+        /* Replace a stale socket from an earlier run, but nothing else.
+         * Stale means nobody is listening anymore, so connecting is refused;
+         * a live instance keeps its socket. */
+        struct stat st;
+        if (lstat(socket_path, &st) == 0) {
+            if (!S_ISSOCK(st.st_mode)) {
+                std::cerr << "Not a socket, refusing to replace it: "
+                    << socket_path << std::endl;
+                return false;
+            }
+            fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            bool stale = fd >= 0
+                && connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr))
+                && errno == ECONNREFUSED;
+            if (fd >= 0) {
+                close(fd);
+            }
+            if (!stale) {
+                std::cerr << "Socket is in use, refusing to replace it: "
+                    << socket_path << std::endl;
+                return false;
+            }
+            unlink(socket_path);
+        }
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr))) {
+            perror("metrics socket");
+            return false;
+        }
+        metrics_socket_path = socket_path;
+    } else {
+        /* Loopback only: there's no authentication whatsoever. */
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(port);
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        int yes = 1;
+        if (fd < 0
+                || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes))
+                || bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr))) {
+            perror("metrics port");
+            return false;
+        }
+    }
+    if (listen(fd, 8)) {
+        perror("metrics listen");
+        return false;
+    }
+
+    search_thread = pthread_self();
+    std::thread(serve_metrics, fd).detach();
+    return true;
+}
+
+/* One search for one goal.  All of its state lives in here, so many solves
+ * can coexist, and 'run' can stop after any number of expansions and later
+ * resume where it left off.  Invariants:
+ * - 'list_open' and 'list_closed' contain nodes for mutually exclusive
+ *   sets of values
+ * - the nodes in 'list_closed' can only be combined in ways that generate
+ *   values for which we already have a node in either list.
+ * - a node in 'list_closed' represents an expression of minimum 'n_terms'. */
+class solver {
+public:
+    enum status_t { SEARCHING, DONE, EXHAUSTED };
+
+private:
+    arith_t goal;
+    /* Minimum shortest-known expression for the goal.
+     * Initialized by a very rough upper bound */
+    size_t goal_seen_n_terms;
+    /* Whether 'goal' is sought at all.  Approximation mode and shared
+     * levels only want the levels, so they must not tighten the bound. */
+    bool seek_goal = true;
+    bool verbose = true;
+
+    /* Both lists live inside the arena, and are never destroyed.  So
+     * destroying a solver doesn't have to visit each node, as all of them
+     * are trivially destructible anyway; it just frees the arena. */
+    std::unique_ptr<arena_t> arena;
+    list_closed_t& list_closed;
+    list_open_t& list_open;
+    /* The values of 'list_closed', indexed by n_terms, in the order they
+     * were closed.  This is what the expansion loop actually walks, as
+     * contiguous arrays are much friendlier to the kernels than a hash map. */
+    std::vector<closed_level_t> closed_levels;
+    /* With '--compress', the levels below 'packed_levels.size()' have been
+     * moved from 'closed_levels' into here. */
+    std::vector<packed_level_t> packed_levels;
+    closed_level_t unpacked; /* Reused to avoid reallocation. */
+    /* Word mode keeps its levels here instead of in 'closed_levels': values
+     * fit in 32 bits, and 'word_kernel' is twice as wide on those. */
+    std::vector<word_level_t> word_levels;
+    /* Word mode only: one bit per value, set iff it's in 'list_closed'.
+     * That's 512 MiB for 32 bits, so it comes from 'calloc': only the pages
+     * that actually get touched cost anything. */
+    struct free_deleter {
+        void operator()(uint32_t* p) const {
+            free(p);
+        }
+    };
+    std::unique_ptr<uint32_t[], free_deleter> closed_bits;
+    std::vector<uint32_t> word_results; /* Reused to avoid reallocation. */
+    std::vector<unsigned char> word_unseen; /* Likewise. */
+    /* Batch mode: the levels below 'n_shared' and their closed nodes are
+     * read from 'shared' instead, which must outlive this solver. */
+    const solver* shared = nullptr;
+    size_t n_shared = 0;
+    /* One bit per hash of a value closed in 'shared'.  Almost every value
+     * 'discover' sees isn't, and this says so without a second hash lookup. */
+    static const unsigned shared_filter_bits = 12;
+    uint64_t shared_filter[(1 << shared_filter_bits) / 64] = {};
+
+    static size_t filter_slot(arith_t val) {
+        return static_cast<size_t>((static_cast<uint64_t>(val)
+            * UINT64_C(0x9e3779b97f4a7c15)) >> (64 - shared_filter_bits));
+    }
+
+    /* Where 'run' left off. */
+    status_t status = SEARCHING;
+    size_t last_n_terms = 0; /* Of the most recently expanded node. */
     size_t counter = 0, next_print = 100;
-    expr_node node; /* Actually 'while'-scoped. */
-    do {
-        if (list_open.size() == 0) {
-            std::cout << "Goal can't be reached,"
-                " or one of the assumptions was violated." << std::endl;
-            return 1;
+    std::vector<unsigned char> in_range; /* Reused to avoid reallocation. */
+    /* Indexed by the n_terms of the expanded node. */
+    std::vector<prune_stats_t> prune_stats;
+
+    /* Which solver holds the values of 'level'. */
+    const solver& owner(size_t level) const {
+        return level < n_shared ? *shared : *this;
+    }
+
+    size_t level_count(size_t level) const {
+        if (word_bits != 0) {
+            return word_levels[level].size();
+        }
+        const solver& o = owner(level);
+        return level < o.packed_levels.size()
+            ? o.packed_levels[level].size() : o.closed_levels[level].size();
+    }
+
+    /* Pack all levels below 'n_terms', as they won't change anymore. */
+    void freeze_below(size_t n_terms) {
+        n_terms = std::min(n_terms, closed_levels.size());
+        while (packed_levels.size() < n_terms) {
+            closed_level_t& level = closed_levels[packed_levels.size()];
+            packed_levels.emplace_back(level);
+            closed_level_t().swap(level);
+        }
+    }
+
+    /* Hand all values of 'level' to 'f', in tiles: f(values, count, flags).
+     * With 'check', 'flags' are the 'range_bit's of each value against 'a'.
+     * Packed levels get decoded a tile's worth of blocks at a time, right
+     * before use, and range-checked in the same pass.  Only the last block
+     * of a level can be short, so the decoded blocks are always contiguous. */
+    template <typename F>
+    void for_each_tile(size_t level, bool check, arith_t a, F&& f) {
+        const solver& o = owner(level);
+        in_range.resize(std::max(tile_size, block_size));
+        if (level < o.packed_levels.size()) {
+            const packed_level_t& packed = o.packed_levels[level];
+            size_t per_tile = std::max<size_t>(tile_size / block_size, 1);
+            unpacked.resize(per_tile * block_size);
+            for (size_t b = 0; b < packed.n_blocks(); b += per_tile) {
+                size_t last = std::min(b + per_tile, packed.n_blocks());
+                size_t n = 0;
+                for (size_t c = b; c < last; ++c) {
+                    n += check
+                        ? packed.check(c, a, unpacked.data() + n, in_range.data() + n)
+                        : packed.unpack(c, unpacked.data() + n);
+                }
+                f(unpacked.data(), n, in_range.data());
+            }
+            return;
+        }
+        const closed_level_t& peers = o.closed_levels[level];
+        for (size_t start = 0; start < peers.size(); start += tile_size) {
+            size_t n = std::min(tile_size, peers.size() - start);
+            if (check) {
+                range_kernel(a, peers.data() + start, n, in_range.data());
+            }
+            f(peers.data() + start, n, in_range.data());
+        }
+    }
+
+    /* What 'list_open' should prune with. */
+    size_t recache_bound() const {
+        return prune_recache ? goal_seen_n_terms : SIZE_MAX;
+    }
+
+    /* Null if 'val' isn't closed yet, neither here nor in 'shared'. */
+    const expr_node* find_closed(arith_t val) const {
+        list_closed_t::const_iterator it = list_closed.find(val);
+        if (it != list_closed.end()) {
+            return &it->second;
+        }
+        size_t slot = filter_slot(val);
+        if (shared != nullptr && ((shared_filter[slot / 64] >> (slot % 64)) & 1)) {
+            it = shared->list_closed.find(val);
+            if (it != shared->list_closed.end()) {
+                return &it->second;
+            }
+        }
+        return nullptr;
+    }
+
+    const expr_node& lookup_best_known(arith_t val) const {
+        if (const expr_node* closed = find_closed(val)) {
+            return *closed;
+        }
+        return list_open.at(val);
+    }
+
+    void discover(arith_t val, const expr_node& node) {
+        /* Only add to open list if not already known in closed list.
+         * (Avoid rediscovering easily-generated values like 0 or 1.)
+         * In word mode, 'word_kernel' already checked the closed bitset. */
+        if (word_bits == 0 && find_closed(val) != nullptr) {
+            return;
+        }
+        /* In rational mode, 'combine_rational' already checked this,
+         * and in word mode there's no such thing as too big. */
+        arith_t abs_val = labs(val);
+        if (denominators == 1 && word_bits == 0 && abs_val >= max_relevant) {
+            return;
+        }
+        if (node.n_terms >= goal_seen_n_terms) {
+            /* Don't care about a node if it can't possibly yield a
+             * better expression. */
+            if (prune_discover) {
+                prune_stats[last_n_terms].rejected += 1;
+                return;
+            }
+        }
+        list_open.push(val, node);
+        if (seek_goal && val == goal && node.n_terms < goal_seen_n_terms) {
+            goal_seen_n_terms = node.n_terms;
+            metrics.bound_improvements.fetch_add(1, std::memory_order_relaxed);
+            if (verbose) {
+                std::cout << "One way (" << node.n_terms << " terms) = ";
+                print_expr(goal);
+                std::cout << std::endl;
+            }
+        }
+    }
+
+    void generate_against(arith_t a_val, const expr_node& a,
+                          arith_t b_val, size_t b_n_terms,
+                          unsigned char in_range) {
+        expr_node node;
+        node.n_terms = a.n_terms + b_n_terms;
+        assert(node.n_terms >= 2);
+
+        node.val_left = a_val;
+        node.val_right = b_val;
+        if (b_val != 0 && a_val % b_val == 0) {
+            node.op = OP_DIV;   discover(a_val / b_val, node);
+        }
+        if (in_range & RANGE_MINUS) {
+            node.op = OP_MINUS; discover(a_val - b_val, node);
+        }
+        if (in_range & RANGE_MULT) {
+            node.op = OP_MULT ; discover(a_val * b_val, node);
+        }
+        if (in_range & RANGE_PLUS) {
+            node.op = OP_PLUS ; discover(a_val + b_val, node);
+        }
+
+        /* Try to avoid needless duplicates */
+        if (b_val != a_val) {
+            node.val_left = b_val;
+            node.val_right = a_val;
+            if (a_val != 0 && b_val % a_val == 0) {
+                node.op = OP_DIV;   discover(b_val / a_val, node);
+            }
+            if (in_range & RANGE_MINUS_REV) {
+                node.op = OP_MINUS; discover(b_val - a_val, node);
+            }
+        }
+    }
+
+    /* Like 'generate_against', but for rational mode.  There's no range
+     * kernel for that, and division doesn't have to be exact anymore. */
+    void generate_rational(arith_t a_val, const expr_node& a,
+                           arith_t b_val, size_t b_n_terms) {
+        static const arith_op forward_ops[] = {OP_DIV, OP_MINUS, OP_MULT, OP_PLUS};
+        static const arith_op backward_ops[] = {OP_DIV, OP_MINUS};
+        expr_node node;
+        node.n_terms = a.n_terms + b_n_terms;
+        arith_t val;
+
+        node.val_left = a_val;
+        node.val_right = b_val;
+        for (arith_op op : forward_ops) {
+            if (combine_rational(op, a_val, b_val, val)) {
+                node.op = op;
+                discover(val, node);
+            }
+        }
+
+        /* Try to avoid needless duplicates */
+        if (b_val != a_val) {
+            node.val_left = b_val;
+            node.val_right = a_val;
+            for (arith_op op : backward_ops) {
+                if (combine_rational(op, b_val, a_val, val)) {
+                    node.op = op;
+                    discover(val, node);
+                }
+            }
         }
+    }
+
+    /* Like 'generate_against', but for word mode, and a whole tile at once. */
+    void generate_words(uint32_t a_val, const expr_node& a,
+                        const uint32_t* peers, size_t n, size_t b_n_terms) {
+        word_results.resize(n_word_ops * n);
+        word_unseen.resize(n_word_ops * n);
+        word_kernel(a_val, peers, n, closed_bits.get(),
+                    word_results.data(), word_unseen.data());
+
+        expr_node node;
+        node.n_terms = a.n_terms + b_n_terms;
+        for (size_t k = 0; k < n_word_ops; ++k) {
+            const word_op_t& op = word_ops[k];
+            node.op = op.op;
+            for (size_t i = 0; i < n; ++i) {
+                /* Try to avoid needless duplicates */
+                if (!word_unseen[k * n + i] || (op.reversed && peers[i] == a_val)) {
+                    continue;
+                }
+                node.val_left = op.reversed ? peers[i] : a_val;
+                node.val_right = op.reversed ? a_val : peers[i];
+                discover(word_results[k * n + i], node);
+            }
+        }
+    }
+
+    /* A fresh bitset for word mode, or a copy of 'from'.  Null otherwise. */
+    static uint32_t* make_closed_bits(const uint32_t* from) {
+        if (word_bits == 0) {
+            return nullptr;
+        }
+        size_t n_words = (static_cast<size_t>(word_mask) >> 5) + 1;
+        uint32_t* bits = static_cast<uint32_t*>(calloc(n_words, sizeof(uint32_t)));
+        if (bits == nullptr) {
+            throw std::bad_alloc();
+        }
+        if (from != nullptr) {
+            memcpy(bits, from, n_words * sizeof(uint32_t));
+        }
+        return bits;
+    }
+
+    /* Calibrate on the values closed so far, timing whichever kernel this
+     * mode runs: word values would be out of range for 'range_kernel'. */
+    void tune() {
+        tune_pending = false;
+        if (denominators != 1) {
+            std::cout << "Not tuning: --rational doesn't use the kernels."
+                << std::endl;
+            return;
+        }
+        if (word_bits != 0) {
+            word_level_t as, peers;
+            if (!tune_sample(word_levels, as, peers)) {
+                return;
+            }
+            const uint32_t* closed = closed_bits.get();
+            calibrate([&](const isa_variant& variant, size_t tile) {
+                return time_word_kernel(variant.word_kernel, tile, as, peers, closed);
+            });
+            return;
+        }
+        closed_level_t as, peers;
+        if (!tune_sample(levels(), as, peers)) {
+            return;
+        }
+        if (compress_levels) {
+            packed_level_t packed(peers);
+            calibrate([&](const isa_variant& variant, size_t tile) {
+                return time_packed_kernel(variant.packed_kernel, tile, as, packed);
+            });
+            return;
+        }
+        calibrate([&](const isa_variant& variant, size_t tile) {
+            return time_range_kernel(variant.range_kernel, tile, as, peers);
+        });
+    }
 
+    /* Close the cheapest open node, and generate it against all closed ones. */
+    void expand_one() {
         arith_t val;
-        list_open.pop_into(val, node);
+        expr_node node;
+        list_open.pop_into(val, node, recache_bound(), goal);
+        last_n_terms = node.n_terms;
+        if (prune_stats.size() <= node.n_terms) {
+            prune_stats.resize(node.n_terms + 1);
+        }
+        prune_stats[node.n_terms].expanded += 1;
+        metrics.level.store(node.n_terms, std::memory_order_relaxed);
+        if (compress_levels) {
+            freeze_below(node.n_terms);
+        }
+        if (tune_pending && node.n_terms >= tune_level) {
+            tune();
+        }
         if (++counter == next_print) {
-            std::cout << "Expanding " << val << " at depth " << node.n_terms
-                      << ", " << list_open.size() << " open ("
-                      << list_open.level_size() << " on current level), "
-                      << list_closed.size() << " closed." << std::endl;
+            if (verbose) {
+                std::cout << "Expanding ";
+                print_value(val);
+                std::cout << " at depth " << node.n_terms
+                          << ", " << list_open.size() << " open ("
+                          << list_open.level_size() << " on current level), "
+                          << closed_size() << " closed." << std::endl;
+            }
             next_print = (next_print * 3) / 2;
         }
 
         /* First add it to the closed list, so it can be
          * "generated against" itself: */
         list_closed.emplace(val, node);
+        size_t n_levels;
+        if (word_bits != 0) {
+            uint32_t word = static_cast<uint32_t>(val);
+            if (word_levels.size() <= node.n_terms) {
+                word_levels.resize(node.n_terms + 1);
+            }
+            word_levels[node.n_terms].push_back(word);
+            closed_bits[word >> 5] |= static_cast<uint32_t>(1) << (word & 31);
+            n_levels = word_levels.size();
+        } else {
+            if (closed_levels.size() <= node.n_terms) {
+                closed_levels.resize(node.n_terms + 1);
+            }
+            closed_levels[node.n_terms].push_back(val);
+            n_levels = closed_levels.size();
+        }
 
-        assert(val != goal);
+        /* The loop condition stops before the goal itself is expanded. */
+        assert(!seek_goal || val != goal || !prune_loop);
 
-        for (const list_closed_t::value_type& peer_kv : list_closed) {
-            generate_against(val, node, peer_kv.first, peer_kv.second);
+        size_t pairs = 0;
+        for (size_t level = 1; level < n_levels; ++level) {
+            if (node.n_terms + level >= goal_seen_n_terms && prune_discover) {
+                /* 'discover' would reject everything from here on. */
+                for (; level < n_levels; ++level) {
+                    prune_stats[node.n_terms].pairs_skipped += level_count(level);
+                }
+                break;
+            }
+            if (word_bits != 0) {
+                const word_level_t& peers = word_levels[level];
+                for (size_t start = 0; start < peers.size(); start += tile_size) {
+                    size_t n = std::min(tile_size, peers.size() - start);
+                    generate_words(static_cast<uint32_t>(val), node,
+                                   peers.data() + start, n, level);
+                    pairs += n;
+                }
+                continue;
+            }
+            bool check = denominators == 1;
+            for_each_tile(level, check, val, [&](const arith_t* peers, size_t n,
+                                                 const unsigned char* flags) {
+                if (denominators != 1) {
+                    for (size_t i = 0; i < n; ++i) {
+                        generate_rational(val, node, peers[i], level);
+                    }
+                } else {
+                    for (size_t i = 0; i < n; ++i) {
+                        generate_against(val, node, peers[i], level, flags[i]);
+                    }
+                }
+                pairs += n;
+            });
         }
-        /* Only loop as long as there's at least one more term that could be shaved off. */
-    } while (goal_seen_n_terms > node.n_terms + 1);
+
+        std::memory_order relaxed = std::memory_order_relaxed;
+        metrics.expansions.fetch_add(1, relaxed);
+        metrics.pairs.fetch_add(pairs, relaxed);
+        metrics.open_size.store(list_open.size(), relaxed);
+        metrics.closed_size.store(closed_size(), relaxed);
+        metrics.goal_bound.store(goal_seen_n_terms, relaxed);
+    }
+
+public:
+    /* 'goal' and the 'provide'd values are plain integers, even in
+     * rational mode.  'get_goal' and 'print_expr' use the encoded value. */
+    explicit solver(arith_t goal)
+        : goal(key_of(goal)),
+          goal_seen_n_terms(static_cast<size_t>(labs(goal)) + 10),
+          arena(new arena_t),
+          list_closed(arena->create<list_closed_t>(
+              list_closed_t::allocator_type(arena.get()))),
+          list_open(arena->create<list_open_t>(arena.get())),
+          closed_bits(make_closed_bits(nullptr)) {
+    }
+
+    solver(const solver&) = delete;
+    solver& operator=(const solver&) = delete;
+
+    /* Continue from the levels that 'shared' already closed, but look for
+     * a different goal.  The goal may well be among them already.  Those
+     * levels are only read, never copied; only the open list is. */
+    solver(const solver& base, arith_t new_goal)
+        : goal(key_of(new_goal)),
+          goal_seen_n_terms(static_cast<size_t>(labs(new_goal)) + 10),
+          verbose(base.verbose),
+          arena(new arena_t),
+          list_closed(arena->create<list_closed_t>(
+              list_closed_t::allocator_type(arena.get()))),
+          list_open(arena->create<list_open_t>(base.list_open, arena.get())),
+          closed_levels(base.closed_levels.size()),
+          closed_bits(make_closed_bits(base.closed_bits.get())),
+          shared(&base),
+          n_shared(base.closed_levels.size()),
+          status(base.status),
+          last_n_terms(base.last_n_terms),
+          counter(base.counter),
+          next_print(base.next_print) {
+        assert(base.shared == nullptr);
+        for (const list_closed_t::value_type& entry : base.list_closed) {
+            size_t slot = filter_slot(entry.first);
+            shared_filter[slot / 64] |= static_cast<uint64_t>(1) << (slot % 64);
+        }
+        if (const expr_node* closed = find_closed(goal)) {
+            goal_seen_n_terms = closed->n_terms;
+            status = DONE;
+        } else if (const expr_node* open = list_open.find(goal)) {
+            goal_seen_n_terms = open->n_terms;
+        }
+    }
+
+    /* Returns false, and ignores 'd', if it's too big: the range kernel
+     * relies on all values being below 'max_relevant'.  Word mode wraps
+     * anyway, so there anything goes. */
+    bool provide(arith_t d) {
+        if (word_bits == 0 && labs(d) >= max_relevant) {
+            return false;
+        }
+        d = key_of(d);
+        expr_node node = {.val_left = d, .val_right = d, .n_terms = 1,
+                          .op = OP_NONE};
+        list_open.push(d, node);
+        if (seek_goal && d == goal) {
+            goal_seen_n_terms = 1;
+        }
+        return true;
+    }
+
+    void set_verbose(bool enable) {
+        verbose = enable;
+        list_open.set_verbose(enable);
+    }
+
+    /* Don't look for the goal, but close all levels up to 'max_terms - 1'. */
+    void seek_levels(size_t max_terms) {
+        seek_goal = false;
+        goal_seen_n_terms = max_terms + 1;
+    }
+
+    /* Close all levels below 'n_terms', no matter what the goal is. */
+    void close_below(size_t n_terms) {
+        seek_goal = false;
+        while (list_open.size() != 0
+                && list_open.peek_n_terms(recache_bound(), goal) < n_terms) {
+            expand_one();
+        }
+    }
+
+    /* Expand at most 'budget' nodes, then return.  Call again to resume.
+     * DONE means 'goal_seen_n_terms' is proven minimal, EXHAUSTED means
+     * the open list ran dry without ever seeing the goal. */
+    status_t run(size_t budget) {
+        for (; status == SEARCHING && budget > 0; --budget) {
+            /* Only go on as long as there's at least one more term
+             * that could be shaved off. */
+            if (goal_seen_n_terms <= last_n_terms + 1 && prune_loop) {
+                status = DONE;
+                if (last_n_terms < prune_stats.size()) {
+                    prune_stats[last_n_terms].left_open = list_open.size();
+                }
+            } else if (list_open.size() == 0) {
+                bool seen = seek_goal && find_closed(goal) != nullptr;
+                status = seen ? DONE : EXHAUSTED;
+            } else {
+                expand_one();
+            }
+        }
+        return status;
+    }
+
+    arith_t get_goal() const {
+        return goal;
+    }
+
+    size_t goal_n_terms() const {
+        return goal_seen_n_terms;
+    }
+
+    size_t closed_size() const {
+        return list_closed.size() + (shared != nullptr ? shared->closed_size() : 0);
+    }
+
+    /* A copy of all closed values, by level.  Packed levels come out sorted. */
+    std::vector<closed_level_t> levels() const {
+        std::vector<closed_level_t> all(closed_levels);
+        for (size_t level = 0; level < packed_levels.size(); ++level) {
+            const packed_level_t& packed = packed_levels[level];
+            all[level].resize(packed.size());
+            for (size_t b = 0; b < packed.n_blocks(); ++b) {
+                packed.unpack(b, all[level].data() + b * block_size);
+            }
+        }
+        if (shared != nullptr) {
+            std::vector<closed_level_t> base = shared->levels();
+            for (size_t level = 0; level < n_shared; ++level) {
+                all[level].swap(base[level]);
+            }
+        }
+        return all;
+    }
+
+    void print_prune_report() const {
+        std::cout << "Pruning report (" << (prune_recache ? "" : "no ")
+            << "recache, " << (prune_discover ? "" : "no ") << "discover, "
+            << (prune_loop ? "" : "no ") << "loop):" << std::endl;
+        std::cout << "level   expanded   discover:rejected  discover:pairs"
+            "   recache:erased    loop:left_open" << std::endl;
+        prune_stats_t total;
+        for (size_t level = 1; level < prune_stats.size(); ++level) {
+            const prune_stats_t& stats = prune_stats[level];
+            size_t erased = list_open.erased_at(level);
+            std::cout << std::setw(5) << level
+                << std::setw(11) << stats.expanded
+                << std::setw(20) << stats.rejected
+                << std::setw(16) << stats.pairs_skipped
+                << std::setw(17) << erased
+                << std::setw(18) << stats.left_open << std::endl;
+            total.expanded += stats.expanded;
+            total.rejected += stats.rejected;
+            total.pairs_skipped += stats.pairs_skipped;
+            total.erased += erased;
+            total.left_open += stats.left_open;
+        }
+        std::cout << "total"
+            << std::setw(11) << total.expanded
+            << std::setw(20) << total.rejected
+            << std::setw(16) << total.pairs_skipped
+            << std::setw(17) << total.erased
+            << std::setw(18) << total.left_open << std::endl;
+    }
+
+    void print_expr(arith_t val) const {
+        const expr_node& node = lookup_best_known(val);
+        if (node.op == OP_NONE) {
+            print_value(val);
+        } else {
+            std::cout << "(";
+            print_expr(node.val_left);
+            std::cout << op_symbol(node.op);
+            print_expr(node.val_right);
+            std::cout << ")";
+        }
+    }
+};
+
+/* Set by '--operands'.  If empty, the defaults below are used. */
+static std::vector<arith_t> custom_operands;
+
+/* Returns false if some operand is out of range, see 'solver::provide'. */
+static bool provide_operands(solver& s) {
+    if (!custom_operands.empty()) {
+        for (arith_t d : custom_operands) {
+            if (!s.provide(d)) {
+                std::cerr << "Operand " << d << " is out of range, it must"
+                    " be below " << max_relevant << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+    /* Tweak this if you feel like it. */
+    s.provide(69);
+    s.provide(420);
+    return true;
+}
+
+/* Approximation mode: instead of hitting 'goal' exactly, find the closest
+ * real value that 'a op b' can reach, where 'a' and 'b' are closed integer
+ * expressions.  Each level is frozen into a sorted array, so every pair of
+ * levels can be joined without materializing all of their combinations. */
+typedef std::vector<double> level_t;
+
+struct approx_t {
+    double err;
+    double value;
+    arith_t val_left;
+    arith_t val_right;
+    arith_op op;
+};
+
+static void consider(approx_t& best, double target, double value,
+                     double left, double right, arith_op op) {
+    double err = fabs(value - target);
+    if (err < best.err) {
+        best.err = err;
+        best.value = value;
+        best.val_left = static_cast<arith_t>(left);
+        best.val_right = static_cast<arith_t>(right);
+        best.op = op;
+    }
+}
+
+/* Check the entries of 'sorted' closest to 'want', i.e. the lower_bound
+ * and its predecessor. */
+template <typename F>
+static void probe_nearest(const level_t& sorted, double want, F&& try_entry) {
+    level_t::const_iterator it =
+        std::lower_bound(sorted.begin(), sorted.end(), want);
+    if (it != sorted.end()) {
+        try_entry(*it);
+    }
+    if (it != sorted.begin()) {
+        try_entry(*(it - 1));
+    }
+}
+
+/* Best 'a op b' for 'a' from level 'as' and 'b' from level 'bs'.
+ * Only the non-commutative operators care about the order of the levels. */
+static void join_levels(approx_t& best, double target,
+                        const level_t& as, const level_t& bs, bool commuted) {
+    if (as.empty() || bs.empty()) {
+        return;
+    }
+
+    if (!commuted) {
+        /* a+b: the sum grows with 'i' and shrinks with 'j'. */
+        size_t i = 0, j = bs.size();
+        while (i < as.size() && j > 0) {
+            double sum = as[i] + bs[j - 1];
+            consider(best, target, sum, as[i], bs[j - 1], OP_PLUS);
+            if (sum < target) {
+                ++i;
+            } else {
+                --j;
+            }
+        }
+    }
+
+    /* a-b: the ideal 'a' is 'target+b', which grows with 'b'. */
+    size_t i = 0;
+    for (double b : bs) {
+        double want = target + b;
+        while (i + 1 < as.size() && as[i + 1] <= want) {
+            ++i;
+        }
+        consider(best, target, as[i] - b, as[i], b, OP_MINUS);
+        if (i + 1 < as.size()) {
+            consider(best, target, as[i + 1] - b, as[i + 1], b, OP_MINUS);
+        }
+    }
+
+    for (double a : as) {
+        if (a == 0) {
+            continue;
+        }
+        if (!commuted) {
+            /* a*b: the ideal 'b' is 'target/a'. */
+            probe_nearest(bs, target / a, [&](double b) {
+                consider(best, target, a * b, a, b, OP_MULT);
+            });
+        }
+        /* b/a: the ideal 'b' is 'target*a'. */
+        probe_nearest(bs, target * a, [&](double b) {
+            consider(best, target, b / a, b, a, OP_DIV);
+        });
+    }
+}
+
+static void print_approx(const solver& s, const approx_t& best) {
+    if (best.op == OP_NONE) {
+        std::cout << best.val_left;
+    } else {
+        std::cout << "(";
+        s.print_expr(best.val_left);
+        std::cout << op_symbol(best.op);
+        s.print_expr(best.val_right);
+        std::cout << ")";
+    }
+}
+
+static int approximate(double target, size_t max_terms) {
+    /* Levels 1 through max_terms-1 have to be closed completely, and level 1
+     * even for 'max_terms == 1'.  The search stops as soon as it pops a node
+     * beyond that. */
+    size_t complete = std::max<size_t>(max_terms, 2);
+    solver s(default_goal);
+    if (!provide_operands(s)) {
+        return 2;
+    }
+    s.seek_levels(complete);
+    s.run(SIZE_MAX);
+
+    std::vector<closed_level_t> closed_levels = s.levels();
+    std::vector<level_t> levels(complete);
+    for (size_t n = 1; n < complete && n < closed_levels.size(); ++n) {
+        levels[n].assign(closed_levels[n].begin(), closed_levels[n].end());
+        std::sort(levels[n].begin(), levels[n].end());
+    }
+
+    std::cout << std::setprecision(15);
+    double best_err = HUGE_VAL;
+    for (size_t n = 1; n <= max_terms; ++n) {
+        approx_t best = {HUGE_VAL, 0, 0, 0, OP_NONE};
+        if (n == 1) {
+            for (double v : levels[1]) {
+                consider(best, target, v, v, v, OP_NONE);
+            }
+        }
+        for (size_t k = 1; k < n; ++k) {
+            join_levels(best, target, levels[k], levels[n - k], k > n - k);
+        }
+        if (best.err == HUGE_VAL) {
+            continue;
+        }
+        std::cout << "Best with " << n << " terms" << (best.err < best_err ? "" : " (no improvement)")
+                  << ": " << best.value << " = ";
+        print_approx(s, best);
+        std::cout << ", off by " << best.err << std::endl;
+        best_err = std::min(best_err, best.err);
+    }
+
+    return 0;
+}
+
+static void print_result(const solver& s) {
+    arith_t goal = s.get_goal();
+    print_value(goal);
+    std::cout << " = ";
+    s.print_expr(goal);
+    std::cout << " (" << s.goal_n_terms() << " terms)" << std::endl;
+}
+
+/* Strict number parsing: all of 'text' must be the number (surrounding
+ * whitespace is fine), and it must fit.  Junk isn't silently 0. */
+static bool parse_integer(const char* text, int base, long& out) {
+    char* end;
+    errno = 0;
+    out = strtol(text, &end, base);
+    bool any = end != text;
+    while (*end == ' ' || *end == '\t' || *end == '\r' || *end == '\n') {
+        ++end;
+    }
+    return any && *end == '\0' && errno == 0;
+}
+
+static bool parse_real(const char* text, double& out) {
+    char* end;
+    errno = 0;
+    out = strtod(text, &end);
+    return end != text && *end == '\0' && errno == 0;
+}
+
+/* Like 'parse_integer' for a count flag, but complains about bad values. */
+static bool parse_count(const char* flag, const char* text, size_t& out) {
+    long value;
+    if (!parse_integer(text, 10, value) || value < 0) {
+        std::cerr << "Bad " << flag << ": " << text << std::endl;
+        return false;
+    }
+    out = static_cast<size_t>(value);
+    return true;
+}
+
+/* Batch mode: many small goals, one per line on stdin, all solved by one
+ * thread.  Each solve gets 'slice' expansions at a time, round-robin, so
+ * cheap goals finish early instead of waiting behind expensive ones.  The
+ * first levels don't depend on the goal, so they are computed only once,
+ * and every solve reads them from there; it only copies the open list.
+ * At most 'batch_slots' solves run at once, the next goal is read from
+ * stdin whenever one of them finishes.  Lines that aren't a number are
+ * reported and skipped. */
+static const size_t shared_levels = 4;
+static const size_t batch_slots = 256;
+
+static int run_batch(size_t slice) {
+    solver shared(default_goal);
+    if (!provide_operands(shared)) {
+        return 2;
+    }
+    shared.set_verbose(false);
+    shared.close_below(shared_levels);
+
+    std::vector<std::unique_ptr<solver> > active;
+    std::string line;
+    size_t line_no = 0;
+    arith_t goal;
+    bool more = true;
+
+    int rc = 0;
+    while (true) {
+        while (more && active.size() < batch_slots) {
+            more = static_cast<bool>(std::getline(std::cin, line));
+            if (!more) {
+                break;
+            }
+            ++line_no;
+            if (line.find_first_not_of(" \t\r") == std::string::npos) {
+                continue;
+            }
+            if (!parse_integer(line.c_str(), 0, goal)) {
+                std::cerr << "Line " << line_no << ": not a goal, skipped: "
+                    << line << std::endl;
+                rc = 1;
+                continue;
+            }
+            active.emplace_back(new solver(shared, goal));
+        }
+        metrics.solves_active.store(active.size(), std::memory_order_relaxed);
+        if (active.empty()) {
+            break;
+        }
+        for (size_t i = 0; i < active.size(); /* Manually */) {
+            solver::status_t status = active[i]->run(slice);
+            if (status == solver::SEARCHING) {
+                ++i;
+                continue;
+            }
+            if (status == solver::DONE) {
+                print_result(*active[i]);
+            } else {
+                print_value(active[i]->get_goal());
+                std::cout << " can't be reached,"
+                    " or one of the assumptions was violated." << std::endl;
+                rc = 1;
+            }
+            /* Order doesn't matter, so don't shift everything. */
+            active[i].swap(active.back());
+            active.pop_back();
+            metrics.solves_active.store(active.size(), std::memory_order_relaxed);
+            metrics.solves_finished.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    return rc;
+}
+
+/* Leave without running any destructors: the system reclaims everything
+ * at once anyway, which is much faster than tearing down huge state. */
+static void fast_exit(int rc) {
+    if (metrics_socket_path != nullptr) {
+        unlink(metrics_socket_path);
+    }
+    std::cout.flush();
+    std::cerr.flush();
+    _exit(rc);
+}
+
+int main(int argc, char** argv) {
+    bool approx = false;
+    double approx_target = 0;
+    size_t approx_terms = 7;
+    const char* isa = nullptr;
+    arith_t goal = default_goal;
+    bool batch = false;
+    size_t slice = 64;
+    bool report = false;
+    size_t metrics_port = 0;
+    const char* metrics_socket = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--approx") && i + 1 < argc) {
+            approx = true;
+            if (!parse_real(argv[++i], approx_target)) {
+                std::cerr << "Bad --approx: " << argv[i] << std::endl;
+                return 2;
+            }
+        } else if (!strcmp(argv[i], "--terms") && i + 1 < argc) {
+            if (!parse_count("--terms", argv[++i], approx_terms)) {
+                return 2;
+            }
+        } else if (!strcmp(argv[i], "--isa") && i + 1 < argc) {
+            isa = argv[++i];
+            isa_forced = true;
+        } else if (!strcmp(argv[i], "--tune")) {
+            tune_pending = true;
+        } else if (!strcmp(argv[i], "--profile") && i + 1 < argc) {
+            profile_path = argv[++i];
+        } else if (!strcmp(argv[i], "--goal") && i + 1 < argc) {
+            if (!parse_integer(argv[++i], 0, goal)) {
+                std::cerr << "Bad --goal: " << argv[i] << std::endl;
+                return 2;
+            }
+        } else if (!strcmp(argv[i], "--batch")) {
+            batch = true;
+        } else if (!strcmp(argv[i], "--slice") && i + 1 < argc) {
+            if (!parse_count("--slice", argv[++i], slice)) {
+                return 2;
+            }
+        } else if (!strcmp(argv[i], "--operands") && i + 1 < argc) {
+            /* Comma-separated, hex is fine too. */
+            const char* pos = argv[i + 1];
+            char* end;
+            do {
+                custom_operands.push_back(strtol(pos, &end, 0));
+                if (end == pos || (*end != ',' && *end != '\0')) {
+                    std::cerr << "Bad --operands: " << argv[i + 1] << std::endl;
+                    return 2;
+                }
+                pos = end + 1;
+            } while (*end == ',');
+            ++i;
+        } else if (!strcmp(argv[i], "--word") && i + 1 < argc) {
+            size_t bits;
+            if (!parse_count("--word", argv[++i], bits)) {
+                return 2;
+            }
+            word_bits = static_cast<unsigned>(std::min<size_t>(bits, 64));
+        } else if (!strcmp(argv[i], "--rational") && i + 1 < argc) {
+            if (!parse_integer(argv[++i], 10, denominators)) {
+                std::cerr << "Bad --rational: " << argv[i] << std::endl;
+                return 2;
+            }
+        } else if (!strcmp(argv[i], "--compress")) {
+            compress_levels = true;
+        } else if (!strcmp(argv[i], "--prune-report")) {
+            report = true;
+        } else if (!strcmp(argv[i], "--no-prune") && i + 1 < argc
+                && !strcmp(argv[i + 1], "recache")) {
+            prune_recache = false;
+            ++i;
+        } else if (!strcmp(argv[i], "--no-prune") && i + 1 < argc
+                && !strcmp(argv[i + 1], "discover")) {
+            prune_discover = false;
+            ++i;
+        } else if (!strcmp(argv[i], "--no-prune") && i + 1 < argc
+                && !strcmp(argv[i + 1], "loop")) {
+            prune_loop = false;
+            ++i;
+        } else if (!strcmp(argv[i], "--metrics-port") && i + 1 < argc) {
+            if (!parse_count("--metrics-port", argv[++i], metrics_port)) {
+                return 2;
+            }
+        } else if (!strcmp(argv[i], "--metrics-socket") && i + 1 < argc) {
+            metrics_socket = argv[++i];
+        } else {
+            std::cerr << "Usage: " << argv[0]
+                << " [--goal N | --batch [--slice N]"
+                   " | --approx TARGET [--terms N]] [--isa NAME]"
+                   " [--tune] [--profile FILE]"
+                   " [--metrics-port PORT | --metrics-socket PATH]"
+                   " [--rational D] [--prune-report]"
+                   " [--no-prune recache|discover|loop] [--compress]"
+                   " [--word 8|16|32] [--operands A,B,...]" << std::endl;
+            return 2;
+        }
+    }
+    if (word_bits != 0) {
+        if (word_bits != 8 && word_bits != 16 && word_bits != 32) {
+            std::cerr << "--word needs 8, 16 or 32 bits" << std::endl;
+            return 2;
+        }
+        if (denominators != 1 || approx || batch || compress_levels) {
+            std::cerr << "--word doesn't work with --rational, --approx,"
+                " --batch or --compress" << std::endl;
+            return 2;
+        }
+        word_mask = static_cast<uint32_t>(~static_cast<uint64_t>(0) >> (64 - word_bits));
+    }
+    if (denominators < 1 || denominators > max_denominators) {
+        std::cerr << "--rational needs a maximum denominator between 1 and "
+            << max_denominators << std::endl;
+        return 2;
+    }
+    if (metrics_port > 65535 || (metrics_port != 0 && metrics_socket != nullptr)) {
+        std::cerr << "Need either a valid --metrics-port or --metrics-socket"
+            << std::endl;
+        return 2;
+    }
+    if (approx && approx_terms < 1) {
+        std::cerr << "--terms must be at least 1" << std::endl;
+        return 2;
+    }
+    if (approx && denominators != 1) {
+        std::cerr << "--approx only works with integer levels" << std::endl;
+        return 2;
+    }
+    if (report && (approx || batch)) {
+        std::cerr << "--prune-report only works for a single goal" << std::endl;
+        return 2;
+    }
+    if (batch && slice < 1) {
+        std::cerr << "--slice must be at least 1" << std::endl;
+        return 2;
+    }
+    if (!select_isa(isa)) {
+        return 2;
+    }
+    bool loaded = profile_path != nullptr && read_profile();
+    if (profile_path != nullptr && !loaded) {
+        tune_pending = true;
+    }
+    if (!loaded) {
+        std::cout << "Using " << isa_name << " kernels." << std::endl;
+    }
+    /* Last, so that from here on every exit goes through 'fast_exit',
+     * which removes the socket again. */
+    if ((metrics_port != 0 || metrics_socket != nullptr)
+            && !start_metrics(static_cast<unsigned short>(metrics_port),
+                              metrics_socket)) {
+        return 2;
+    }
+    if (approx) {
+        fast_exit(approximate(approx_target, approx_terms));
+    }
+    if (batch) {
+        fast_exit(run_batch(slice));
+    }
+
+    solver s(goal);
+    if (!provide_operands(s)) {
+        fast_exit(2);
+    }
+
+    /* Search */
+    if (s.run(SIZE_MAX) != solver::DONE) {
+        std::cout << "Goal can't be reached,"
+            " or one of the assumptions was violated." << std::endl;
+        if (report) {
+            s.print_prune_report();
+        }
+        fast_exit(1);
+    }
 
     /* Printing */
-    std::cout << "Done after " << list_closed.size()
-        << " steps.  Turns out, you need only " << goal_seen_n_terms
-        << " terms to build " << goal << ":" << std::endl;
-    std::cout << goal << " = ";
-    print_expr(goal);
+    std::cout << "Done after " << s.closed_size()
+        << " steps.  Turns out, you need only " << s.goal_n_terms()
+        << " terms to build ";
+    print_value(s.get_goal());
+    std::cout << ":" << std::endl;
+    print_value(s.get_goal());
+    std::cout << " = ";
+    s.print_expr(s.get_goal());
     std::cout << std::endl;
+    if (report) {
+        s.print_prune_report();
+    }
 
-    return 0;
+    fast_exit(0);
 }